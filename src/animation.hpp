@@ -0,0 +1,74 @@
+#ifndef ANIMATION_HPP
+#define ANIMATION_HPP
+
+#include "common.hpp"
+#include <glm/glm.hpp>
+
+// Voxel animation stored as sparse deltas: every frame keeps only the cells that differ
+// from the frame before it (frame 0 is encoded against the last frame so playback can
+// loop). Playing back touches only the changed cells instead of whole grids.
+class VoxAnimation {
+public:
+    struct VoxelChange {
+        u32 index;
+        u8 value;
+    };
+
+    // Frames must be added in order and all have the same cell count
+    void AddFrame(span<const u8> voxels, const glm::mat4& transform) {
+        if (m_frames.empty()) {
+            m_first_voxels.assign(voxels.begin(), voxels.end());
+            m_frames.push_back({ 0, 0, transform });
+        }
+        else {
+            m_frames.push_back(EncodeDelta(m_last_voxels, voxels, transform));
+        }
+        m_last_voxels.assign(voxels.begin(), voxels.end());
+    }
+    void Finish() {
+        if (!m_frames.empty()) {
+            const Frame loop = EncodeDelta(m_last_voxels, m_first_voxels, m_frames[0].transform);
+            m_frames[0] = loop;
+        }
+        m_first_voxels = vector<u8>();
+        m_last_voxels = vector<u8>();
+        m_current_frame = 0;
+    }
+    // Steps from the current frame to `frame` (wrapped to the frame count), calling
+    // `apply(index, value)` for every cell that changes on the way
+    template<typename ApplyFn>
+    void Seek(u32 frame, ApplyFn&& apply) {
+        frame %= m_frames.size();
+        while (m_current_frame != frame) {
+            m_current_frame = (m_current_frame + 1) % m_frames.size();
+            const Frame& current = m_frames[m_current_frame];
+            for (u32 i = current.first_change; i < current.first_change + current.change_count; i++)
+                apply(m_changes[i].index, m_changes[i].value);
+        }
+    }
+    bool IsAnimated() const { return m_frames.size() > 1; }
+    u32 GetFrameCount() const { return m_frames.size(); }
+    u32 GetChangeCount() const { return m_changes.size(); }
+    glm::mat4 GetTransform() const { return m_frames[m_current_frame].transform; }
+private:
+    struct Frame {
+        u32 first_change;
+        u32 change_count;
+        glm::mat4 transform;
+    };
+    Frame EncodeDelta(span<const u8> from, span<const u8> to, const glm::mat4& transform) {
+        ASSERT(from.size() == to.size(), "Animation frames differ in size!");
+        Frame frame = { (u32)m_changes.size(), 0, transform };
+        for (u32 i = 0; i < to.size(); i++)
+            if (from[i] != to[i])
+                m_changes.push_back({ i, to[i] });
+        frame.change_count = m_changes.size() - frame.first_change;
+        return frame;
+    }
+    vector<Frame> m_frames;
+    vector<VoxelChange> m_changes;
+    vector<u8> m_first_voxels, m_last_voxels; // only needed while encoding
+    u32 m_current_frame = 0;
+};
+
+#endif
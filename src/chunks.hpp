@@ -0,0 +1,342 @@
+#ifndef CHUNKS_HPP
+#define CHUNKS_HPP
+
+#include "common.hpp"
+#include <chrono>
+#include <glm/glm.hpp>
+
+// Voxel grid stored as 8x8x8 chunks, each with its own palette of the values it contains.
+// A chunk is packed with 1, 2 or 4 bits per cell indexing that palette, with 8 bits
+// holding the values directly, or collapsed to a single value when uniform.
+//
+// Everything lives in one u32 array that is uploaded to the GPU as is:
+//   [0, 2 * chunk_count)  two header words per chunk
+//                         h0 = bits | palette byte offset << 4
+//                         h1 = word offset of the packed cells, or the value if bits == 0
+//   [2 * chunk_count, ..) per chunk slots: palette bytes (1 << bits, absent for 8 bits)
+//                         followed by ChunkCells * bits / 32 words of packed cells
+// Cells are packed x -> y -> z within a chunk, chunks x -> y -> z within the grid.
+//
+// Reads and traversal go to the packed form directly, or to the cache for chunks in it.
+// Edits decompress the chunk into that small cache, and dirty chunks are re-encoded when
+// they leave it; GetData() and GetStats() do not see edits still in the cache. Slots left
+// behind by re-encoding are reclaimed once they make up half of the data.
+class ChunkedVoxels {
+public:
+    static constexpr i32 ChunkEdge = 8;
+    static constexpr u32 ChunkCells = ChunkEdge * ChunkEdge * ChunkEdge;
+    static constexpr u32 CacheSize = 64;
+    struct Stats {
+        u32 chunk_count = 0;
+        array<u32, 9> chunks_by_bits = {}; // indexed by bits per cell, 0 = uniform
+        u64 raw_bytes = 0;
+        u64 packed_bytes = 0;
+        float encode_time = 0; // milliseconds
+    };
+
+    // `voxels` is laid out x -> y -> z, like the raw scene
+    void Build(span<const u8> voxels, const glm::ivec3& size) {
+        const auto start = std::chrono::steady_clock::now();
+        m_size = size;
+        m_grid = (size + ChunkEdge - 1) / ChunkEdge;
+        const u32 chunk_count = m_grid.x * m_grid.y * m_grid.z;
+        m_data.assign(chunk_count * 2, 0);
+        m_garbage_words = 0;
+        m_cache_slots.assign(chunk_count, InvalidSlot);
+        m_cache.resize(CacheSize);
+        for (CacheEntry& entry : m_cache)
+            entry.chunk = InvalidChunk;
+
+        array<u8, ChunkCells> cells;
+        for (i32 cz = 0; cz < m_grid.z; cz++)
+        for (i32 cy = 0; cy < m_grid.y; cy++)
+        for (i32 cx = 0; cx < m_grid.x; cx++) {
+            const glm::ivec3 origin = glm::ivec3(cx, cy, cz) * ChunkEdge;
+            const i32 row_length = std::min(ChunkEdge, size.x - origin.x);
+            cells.fill(0);
+            for (i32 z = 0; z < std::min(ChunkEdge, size.z - origin.z); z++)
+                for (i32 y = 0; y < std::min(ChunkEdge, size.y - origin.y); y++)
+                    memcpy(
+                        &cells[(z * ChunkEdge + y) * ChunkEdge],
+                        &voxels[((origin.z + z) * size.y + origin.y + y) * size.x + origin.x],
+                        row_length
+                    );
+            EncodeChunk((cz * m_grid.y + cy) * m_grid.x + cx, cells.data());
+        }
+
+        m_encode_time = std::chrono::duration<float, std::milli>(
+            std::chrono::steady_clock::now() - start
+        ).count();
+    }
+
+    u8 Get(const glm::ivec3& pos) const {
+        const u32 chunk = ChunkIndex(pos);
+        if (m_cache_slots[chunk] != InvalidSlot)
+            return m_cache[m_cache_slots[chunk]].cells[CellIndex(pos)];
+        return PackedCell(chunk, CellIndex(pos));
+    }
+    void Set(const glm::ivec3& pos, u8 value) {
+        if (Get(pos) == value)
+            return;
+        const u32 chunk = ChunkIndex(pos);
+        CacheChunk(chunk)[CellIndex(pos)] = value;
+        m_cache[m_cache_slots[chunk]].dirty = true;
+    }
+    u8 GetIndex(u32 index) const { return Get(IndexToPos(index)); }
+    void SetIndex(u32 index, u8 value) { Set(IndexToPos(index), value); }
+
+    // Expands the whole grid into `voxels` (x -> y -> z, size.x * size.y * size.z bytes)
+    void Decompress(span<u8> voxels) const {
+        array<u8, ChunkCells> cells;
+        for (i32 cz = 0; cz < m_grid.z; cz++)
+        for (i32 cy = 0; cy < m_grid.y; cy++)
+        for (i32 cx = 0; cx < m_grid.x; cx++) {
+            const u32 chunk = (cz * m_grid.y + cy) * m_grid.x + cx;
+            if (m_cache_slots[chunk] != InvalidSlot)
+                cells = m_cache[m_cache_slots[chunk]].cells;
+            else
+                DecodeChunk(chunk, cells.data());
+            const glm::ivec3 origin = glm::ivec3(cx, cy, cz) * ChunkEdge;
+            const i32 row_length = std::min(ChunkEdge, m_size.x - origin.x);
+            for (i32 z = 0; z < std::min(ChunkEdge, m_size.z - origin.z); z++)
+                for (i32 y = 0; y < std::min(ChunkEdge, m_size.y - origin.y); y++)
+                    memcpy(
+                        &voxels[((origin.z + z) * m_size.y + origin.y + y) * m_size.x + origin.x],
+                        &cells[(z * ChunkEdge + y) * ChunkEdge],
+                        row_length
+                    );
+        }
+    }
+
+    // Walks the grid from `origin` along `dir` (voxel units) and returns the first non-empty
+    // value, or 0 if the ray leaves the grid. Cells are read from the cache when their chunk
+    // is there and from the packed form otherwise, so tracing never touches the cache and
+    // may run on several threads at once.
+    u8 Raycast(const glm::vec3& origin, const glm::vec3& dir) const {
+        glm::vec3 inv_dir;
+        for (i32 i = 0; i < 3; i++)
+            inv_dir[i] = dir[i] != 0 ? 1.0f / dir[i] : 1e30f;
+
+        // Clip against the grid bounds
+        const glm::vec3 t0 = -origin * inv_dir;
+        const glm::vec3 t1 = (glm::vec3(m_size) - origin) * inv_dir;
+        const glm::vec3 t_near = glm::min(t0, t1), t_far = glm::max(t0, t1);
+        const float t_enter = std::max({ t_near.x, t_near.y, t_near.z, 0.0f });
+        const float t_exit = std::min({ t_far.x, t_far.y, t_far.z });
+        if (t_enter >= t_exit)
+            return 0;
+
+        glm::ivec3 map = glm::clamp(
+            glm::ivec3(glm::floor(origin + dir * t_enter)), glm::ivec3(0), m_size - 1
+        );
+        glm::ivec3 step;
+        glm::vec3 t_max, t_delta;
+        for (i32 i = 0; i < 3; i++) {
+            step[i] = dir[i] > 0 ? 1 : (dir[i] < 0 ? -1 : 0);
+            t_delta[i] = std::abs(inv_dir[i]);
+            t_max[i] = step[i] > 0 ? (map[i] + 1 - origin[i]) * inv_dir[i]
+                     : step[i] < 0 ? (map[i] - origin[i]) * inv_dir[i]
+                     : 1e30f;
+        }
+
+        while (true) {
+            const u8 value = Get(map);
+            if (value != 0)
+                return value;
+
+            const i32 axis = t_max.x < t_max.y
+                ? (t_max.x < t_max.z ? 0 : 2)
+                : (t_max.y < t_max.z ? 1 : 2);
+            map[axis] += step[axis];
+            if (map[axis] < 0 || map[axis] >= m_size[axis])
+                return 0;
+            t_max[axis] += t_delta[axis];
+        }
+    }
+
+    span<const u32> GetData() const { return m_data; }
+    glm::ivec3 GetSize() const { return m_size; }
+    Stats GetStats() const {
+        Stats stats;
+        stats.chunk_count = m_cache_slots.size();
+        for (u32 chunk = 0; chunk < stats.chunk_count; chunk++)
+            stats.chunks_by_bits[Bits(chunk)]++;
+        stats.raw_bytes = (u64)m_size.x * m_size.y * m_size.z;
+        stats.packed_bytes = (m_data.size() - m_garbage_words) * sizeof(u32);
+        stats.encode_time = m_encode_time;
+        return stats;
+    }
+    // Decodes every chunk once and returns the average cost of one chunk in nanoseconds
+    float MeasureDecodeTime() const {
+        array<u8, ChunkCells> cells;
+        u64 checksum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (u32 chunk = 0; chunk < m_cache_slots.size(); chunk++) {
+            DecodeChunk(chunk, cells.data());
+            checksum += cells[chunk % ChunkCells];
+        }
+        const float total = std::chrono::duration<float, std::nano>(
+            std::chrono::steady_clock::now() - start
+        ).count();
+        volatile u64 sink = checksum; // keep the loop from being optimized out
+        (void)sink;
+        return m_cache_slots.empty() ? 0 : total / m_cache_slots.size();
+    }
+private:
+    static constexpr u32 InvalidSlot = UINT32_MAX;
+    static constexpr u32 InvalidChunk = UINT32_MAX;
+    struct CacheEntry {
+        u32 chunk;
+        bool dirty;
+        array<u8, ChunkCells> cells;
+    };
+
+    static u32 PaletteWords(u32 bits) { return bits == 8 ? 0 : ((1u << bits) + 3) / 4; }
+    static u32 DataWords(u32 bits) { return ChunkCells * bits / 32; }
+    static u32 SlotWords(u32 bits) { return bits == 0 ? 0 : PaletteWords(bits) + DataWords(bits); }
+
+    u32 Bits(u32 chunk) const { return m_data[chunk * 2] & 15u; }
+    u32 ChunkIndex(const glm::ivec3& pos) const {
+        const glm::ivec3 chunk = pos / ChunkEdge;
+        return (chunk.z * m_grid.y + chunk.y) * m_grid.x + chunk.x;
+    }
+    static u32 CellIndex(const glm::ivec3& pos) {
+        return ((pos.z % ChunkEdge) * ChunkEdge + pos.y % ChunkEdge) * ChunkEdge + pos.x % ChunkEdge;
+    }
+    glm::ivec3 IndexToPos(u32 index) const {
+        return glm::ivec3(index % m_size.x, index / m_size.x % m_size.y, index / (m_size.x * m_size.y));
+    }
+    u8 PackedCell(u32 chunk, u32 cell) const {
+        const u32 h0 = m_data[chunk * 2], h1 = m_data[chunk * 2 + 1];
+        const u32 bits = h0 & 15u;
+        if (bits == 0)
+            return h1;
+        const u32 bit = cell * bits;
+        const u32 idx = (m_data[h1 + (bit >> 5)] >> (bit & 31u)) & ((1u << bits) - 1);
+        if (bits == 8)
+            return idx;
+        return reinterpret_cast<const u8*>(m_data.data())[(h0 >> 4) + idx];
+    }
+    void DecodeChunk(u32 chunk, u8* cells) const {
+        const u32 h0 = m_data[chunk * 2], h1 = m_data[chunk * 2 + 1];
+        const u32 bits = h0 & 15u;
+        if (bits == 0) {
+            memset(cells, h1, ChunkCells);
+            return;
+        }
+        const u32* words = &m_data[h1];
+        const u32 mask = (1u << bits) - 1;
+        const u32 cells_per_word = 32 / bits;
+        if (bits == 8) {
+            memcpy(cells, words, ChunkCells);
+            return;
+        }
+        const u8* palette = reinterpret_cast<const u8*>(m_data.data()) + (h0 >> 4);
+        for (u32 w = 0; w < DataWords(bits); w++) {
+            u32 word = words[w];
+            for (u32 i = 0; i < cells_per_word; i++, word >>= bits)
+                *cells++ = palette[word & mask];
+        }
+    }
+    // Packs `cells` into the chunk's slot, reusing the old slot when the new encoding fits
+    void EncodeChunk(u32 chunk, const u8* cells) {
+        WriteChunk(chunk, cells);
+        if (m_garbage_words > m_data.size() / 2)
+            Compact();
+    }
+    void WriteChunk(u32 chunk, const u8* cells) {
+        array<i16, 256> lookup;
+        lookup.fill(-1);
+        array<u8, 256> palette;
+        u32 palette_size = 0;
+        for (u32 i = 0; i < ChunkCells; i++) {
+            if (lookup[cells[i]] < 0) {
+                lookup[cells[i]] = palette_size;
+                palette[palette_size++] = cells[i];
+            }
+        }
+        const u32 bits =
+            palette_size == 1 ? 0 :
+            palette_size <= 2 ? 1 :
+            palette_size <= 4 ? 2 :
+            palette_size <= 16 ? 4 : 8;
+
+        const u32 old_bits = Bits(chunk);
+        if (bits == 0) {
+            m_garbage_words += SlotWords(old_bits);
+            m_data[chunk * 2] = 0;
+            m_data[chunk * 2 + 1] = palette[0];
+            return;
+        }
+        u32 slot;
+        if (old_bits != 0 && bits <= old_bits) {
+            slot = m_data[chunk * 2 + 1] - PaletteWords(old_bits);
+            m_garbage_words += SlotWords(old_bits) - SlotWords(bits);
+        }
+        else {
+            m_garbage_words += SlotWords(old_bits);
+            slot = m_data.size();
+            m_data.resize(slot + SlotWords(bits));
+        }
+        ASSERT(slot < (1u << 26), "Chunk data exceeds the header's palette offset range!");
+
+        if (bits != 8)
+            memcpy(&m_data[slot], palette.data(), palette_size);
+        u32* words = &m_data[slot + PaletteWords(bits)];
+        memset(words, 0, DataWords(bits) * sizeof(u32));
+        for (u32 i = 0; i < ChunkCells; i++) {
+            const u32 idx = bits == 8 ? cells[i] : (u32)lookup[cells[i]];
+            words[(i * bits) >> 5] |= idx << ((i * bits) & 31u);
+        }
+        m_data[chunk * 2] = bits | (slot * 4) << 4;
+        m_data[chunk * 2 + 1] = slot + PaletteWords(bits);
+    }
+    // Returns the chunk's cells from the cache, decompressing it (and evicting the oldest
+    // entry) if it is not there yet
+    u8* CacheChunk(u32 chunk) {
+        if (m_cache_slots[chunk] != InvalidSlot)
+            return m_cache[m_cache_slots[chunk]].cells.data();
+        const u32 slot = m_cache_next;
+        m_cache_next = (m_cache_next + 1) % CacheSize;
+        CacheEntry& entry = m_cache[slot];
+        if (entry.chunk != InvalidChunk) {
+            if (entry.dirty)
+                EncodeChunk(entry.chunk, entry.cells.data());
+            m_cache_slots[entry.chunk] = InvalidSlot;
+        }
+        DecodeChunk(chunk, entry.cells.data());
+        entry.chunk = chunk;
+        entry.dirty = false;
+        m_cache_slots[chunk] = slot;
+        return entry.cells.data();
+    }
+    // Drops the space left behind by re-encoded chunks
+    void Compact() {
+        const u32 chunk_count = m_cache_slots.size();
+        vector<u32> data(m_data.begin(), m_data.begin() + chunk_count * 2);
+        data.reserve(m_data.size() - m_garbage_words);
+        for (u32 chunk = 0; chunk < chunk_count; chunk++) {
+            const u32 bits = Bits(chunk);
+            if (bits == 0)
+                continue;
+            const u32 old_slot = m_data[chunk * 2 + 1] - PaletteWords(bits);
+            const u32 slot = data.size();
+            data.insert(data.end(), &m_data[old_slot], &m_data[old_slot] + SlotWords(bits));
+            data[chunk * 2] = bits | (slot * 4) << 4;
+            data[chunk * 2 + 1] = slot + PaletteWords(bits);
+        }
+        m_data.swap(data);
+        m_garbage_words = 0;
+    }
+
+    glm::ivec3 m_size = glm::ivec3(0);
+    glm::ivec3 m_grid = glm::ivec3(0);
+    vector<u32> m_data;
+    u32 m_garbage_words = 0;
+    vector<u32> m_cache_slots; // per chunk, index into m_cache or InvalidSlot
+    vector<CacheEntry> m_cache;
+    u32 m_cache_next = 0;
+    float m_encode_time = 0;
+};
+
+#endif
@@ -14,6 +14,14 @@
 #include <format>
 #include <cassert>
 #include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 using u8 = uint8_t;
 using i8 = int8_t;
@@ -40,25 +48,199 @@ template<typename T> using span = std::span<T>;
      ? void(0) \
      : (LOG_FAILED_ASSERT(expr, fmt, ##__VA_ARGS__), exit(1)))
 
+// Bump allocator that serves allocations out of large blocks and frees them all at once.
+// Reset() keeps the blocks, so the next batch reuses memory that is already faulted in.
+class LinearArena {
+public:
+    static constexpr u64 DefaultBlockSize = 16 << 20;
+    struct Stats {
+        u64 allocation_count = 0;
+        u64 allocated_bytes = 0;
+        u64 system_allocation_count = 0; // blocks requested from malloc
+        u64 reserved_bytes = 0;
+    };
+
+    LinearArena(u64 block_size = DefaultBlockSize) : m_block_size(block_size) {}
+    LinearArena(const LinearArena&) = delete;
+    LinearArena& operator=(const LinearArena&) = delete;
+    ~LinearArena() {
+        Release();
+    }
+    void* Alloc(u64 byte_size, u64 alignment = alignof(std::max_align_t)) {
+        m_stats.allocation_count++;
+        m_stats.allocated_bytes += byte_size;
+        for (; m_current < m_blocks.size(); m_current++, m_offset = 0) {
+            const Block& block = m_blocks[m_current];
+            const u64 offset = (m_offset + alignment - 1) / alignment * alignment;
+            if (offset + byte_size <= block.size) {
+                m_offset = offset + byte_size;
+                return block.data + offset;
+            }
+        }
+        const u64 size = std::max(m_block_size, byte_size);
+        u8* data = static_cast<u8*>(malloc(size));
+        ASSERT(data != nullptr, "Could not allocate {} bytes", size);
+        m_blocks.push_back({ data, size });
+        m_stats.system_allocation_count++;
+        m_stats.reserved_bytes += size;
+        m_offset = byte_size;
+        return data;
+    }
+    // Invalidates every allocation but keeps the blocks for reuse
+    void Reset() {
+        m_current = 0;
+        m_offset = 0;
+    }
+    // Returns the blocks to the system
+    void Release() {
+        for (const Block& block : m_blocks)
+            free(block.data);
+        m_blocks.clear();
+        m_stats.reserved_bytes = 0;
+        Reset();
+    }
+    const Stats& GetStats() const { return m_stats; }
+private:
+    struct Block {
+        u8* data;
+        u64 size;
+    };
+    vector<Block> m_blocks;
+    u64 m_block_size;
+    u64 m_current = 0;
+    u64 m_offset = 0;
+    Stats m_stats;
+};
+
+// Append-only byte builder. Give it the final size up front when it is known; otherwise
+// it grows geometrically. Memory is never zero-filled before being written. When backed
+// by an arena the data lives until the arena is reset, otherwise the buffer owns it.
 class ByteBuffer {
 public:
+    ByteBuffer(u64 capacity = 0, LinearArena* arena = nullptr) : m_arena(arena) {
+        Reserve(capacity);
+    }
+    ByteBuffer(const ByteBuffer&) = delete;
+    ByteBuffer& operator=(const ByteBuffer&) = delete;
+    ~ByteBuffer() {
+        if (m_arena == nullptr)
+            free(m_data);
+    }
+    void Reserve(u64 capacity) {
+        if (capacity <= m_capacity)
+            return;
+        if (m_arena == nullptr) {
+            m_data = static_cast<u8*>(realloc(m_data, capacity));
+        }
+        else {
+            u8* data = static_cast<u8*>(m_arena->Alloc(capacity));
+            if (m_size != 0)
+                memcpy(data, m_data, m_size);
+            m_data = data;
+        }
+        ASSERT(m_data != nullptr, "Could not allocate {} bytes", capacity);
+        m_capacity = capacity;
+    }
+    void Append(const void* data, u64 byte_size) {
+        if (m_size + byte_size > m_capacity)
+            Reserve(std::max(m_size + byte_size, m_capacity * 2));
+        memcpy(m_data + m_size, data, byte_size);
+        m_size += byte_size;
+    }
+    // Grows the buffer by `byte_size` and returns the new bytes for the caller to fill
+    span<u8> AppendUninitialized(u64 byte_size) {
+        if (m_size + byte_size > m_capacity)
+            Reserve(std::max(m_size + byte_size, m_capacity * 2));
+        m_size += byte_size;
+        return { m_data + m_size - byte_size, byte_size };
+    }
     template<typename T>
     void Add(const T* object) {
-        m_data.reserve(m_data.size() + sizeof(T));
-        const u8* insert_pos = m_data.data() + m_data.size();
-        m_data.resize(m_data.size() + sizeof(T));
-        memcpy((void*)insert_pos, object, sizeof(T));
+        Append(object, sizeof(T));
     }
     template<typename T> // NOTE: This cannot be deducted for some reason (TODO)
     void Extend(const span<const T>& vec) {
-        m_data.reserve(m_data.size() + vec.size_bytes());
-        const u8* insert_pos = m_data.data() + m_data.size();
-        m_data.resize(m_data.size() + vec.size_bytes());
-        memcpy((void*)insert_pos, vec.data(), vec.size_bytes());
+        Append(vec.data(), vec.size_bytes());
+    }
+    span<const u8> AsSpan() const { return { m_data, m_size }; }
+    u64 GetSize() const { return m_size; }
+private:
+    LinearArena* m_arena;
+    u8* m_data = nullptr;
+    u64 m_size = 0;
+    u64 m_capacity = 0;
+};
+
+// Lock-free single producer / single consumer handoff. The writer always owns a slot of
+// its own and the reader keeps the last value it took, so neither side ever waits;
+// values published faster than they are read are simply dropped.
+template<typename T>
+class TripleBuffer {
+public:
+    T& WriteSlot() { return m_slots[m_write]; }
+    void Publish() {
+        m_write = m_middle.exchange(m_write | DirtyBit, std::memory_order_acq_rel) & IndexMask;
+    }
+    // Returns true if a new value was published since the last call
+    bool Update() {
+        if ((m_middle.load(std::memory_order_relaxed) & DirtyBit) == 0)
+            return false;
+        m_read = m_middle.exchange(m_read, std::memory_order_acq_rel) & IndexMask;
+        return true;
+    }
+    const T& ReadSlot() const { return m_slots[m_read]; }
+private:
+    static constexpr u8 IndexMask = 3, DirtyBit = 4;
+    array<T, 3> m_slots{};
+    u8 m_write = 0, m_read = 1;
+    std::atomic<u8> m_middle = 2;
+};
+
+// Blocking queue with a fixed capacity, for producer/consumer pipelines between threads.
+// After Close(), Pop() keeps draining what is left and returns false once it is empty.
+template<typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(u32 capacity) : m_capacity(capacity) {}
+    void Push(T&& value) {
+        std::unique_lock lock(m_mutex);
+        if (m_items.size() >= m_capacity) {
+            const auto start = std::chrono::steady_clock::now();
+            m_not_full.wait(lock, [&]() { return m_items.size() < m_capacity; });
+            m_push_wait_time += std::chrono::duration<float, std::milli>(
+                std::chrono::steady_clock::now() - start
+            ).count();
+        }
+        m_items.push_back(std::move(value));
+        m_not_empty.notify_one();
+    }
+    bool Pop(T* value) {
+        std::unique_lock lock(m_mutex);
+        m_not_empty.wait(lock, [&]() { return !m_items.empty() || m_closed; });
+        if (m_items.empty())
+            return false;
+        *value = std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+    void Close() {
+        std::lock_guard lock(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+    }
+    // Total time producers spent blocked on a full queue, in milliseconds
+    float GetPushWaitTime() {
+        std::lock_guard lock(m_mutex);
+        return m_push_wait_time;
     }
-    const vector<u8>& AsVec() { return m_data; }
 private:
-    vector<u8> m_data;
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty, m_not_full;
+    std::deque<T> m_items;
+    u32 m_capacity;
+    bool m_closed = false;
+    float m_push_wait_time = 0;
 };
 
 class File {
@@ -78,7 +260,9 @@ public:
         return true;
     }
     void Close() {
-        fclose(m_handle);
+        if (m_handle != nullptr)
+            fclose(m_handle);
+        m_handle = nullptr;
     }
     bool IsValid() {
         return m_handle != nullptr;
@@ -103,6 +287,13 @@ public:
         MoveAt(pos);
         Write(data, byte_size);
     }
+    u32 Size() {
+        const u32 pos = Tell();
+        MoveAt(0, SEEK_END);
+        const u32 size = Tell();
+        MoveAt(pos);
+        return size;
+    }
     void ReadAll(string* str) {
         MoveAt(0, SEEK_END);
         u32 size = Tell();
@@ -112,7 +303,7 @@ public:
     }
     FILE* GetHandle() { return m_handle; }
 private:
-    FILE* m_handle;
+    FILE* m_handle = nullptr;
 };
 
 #endif
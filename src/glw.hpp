@@ -2,6 +2,8 @@
 #define GLW_HPP
 
 #include <string>
+#include <vector>
+#include <atomic>
 #include <cstdint>
 #include <initializer_list>
 #include <span>
@@ -27,9 +29,11 @@ namespace glw {
 
     class Context {
     public:
-        Context(const char* window_name, u32 window_width, u32 window_height, bool fullscreen = false);
+        Context(const char* window_name, u32 window_width, u32 window_height, bool fullscreen = false, bool hidden = false);
         ~Context();
         void Present();
+        void MakeCurrent();
+        void ReleaseCurrent();
         float UpdateDeltaTime();
         u32 GetWindowWidth();
         u32 GetWindowHeight();
@@ -139,6 +143,93 @@ namespace glw {
         }
     };
 
+    // Persistently mapped ring buffer for data that changes every frame. The storage is
+    // split into `region_count` regions: the CPU writes into one while the GPU may still
+    // read the others, and each region is guarded by a fence placed at the end of the
+    // frame that used it. Allocate() may be called from any thread between BeginFrame()
+    // and EndFrame(); the GL calls themselves must stay on the context's thread.
+    class StreamBuffer : public GLObject {
+    public:
+        static constexpr u32 DefaultRegionCount = 3;
+        struct Allocation {
+            std::span<u8> data; // empty if the region is full
+            u32 offset;         // from the start of the buffer
+        };
+
+        StreamBuffer(GLenum buffer_type, u32 region_byte_size, u32 region_count = DefaultRegionCount);
+        ~StreamBuffer();
+        void Bind() const;
+        void BindRangeToIndex(u32 idx, const Allocation& allocation) const;
+        void CopyTo(GLObject* dst, const Allocation& allocation, u32 dst_offset) const;
+        void BeginFrame();
+        void EndFrame();
+        // `alignment` 0 means the buffer type's binding offset alignment, which ranges bound
+        // with BindRangeToIndex() need. Others must divide it; 4 suits copy sources.
+        Allocation Allocate(u32 byte_size, u32 alignment = 0);
+        u32 GetRegionSize() const { return m_region_size; }
+        float GetLastWaitTime() const { return m_last_wait_time; }
+        float GetTotalWaitTime() const { return m_total_wait_time; }
+    private:
+        static constexpr u64 WaitTimeoutNs = 1000000;
+        static u32 AlignUp(u32 byte_size, u32 alignment);
+        GLenum m_buffer_type;
+        u32 m_region_size;
+        u32 m_region_count;
+        u32 m_alignment = 4;
+        u32 m_region = 0;
+        std::atomic<u32> m_head = 0;
+        u8* m_mapped = nullptr;
+        std::vector<GLsync> m_fences;
+        float m_last_wait_time = 0, m_total_wait_time = 0; // milliseconds
+    };
+
+    // Asynchronous readback target: ReadPixels() queues a copy of the bound read framebuffer
+    // and returns immediately, Map() waits for that copy only when the pixels are needed
+    class PixelPackBuffer : public GenericBuffer<u8> {
+    public:
+        PixelPackBuffer() : GenericBuffer<u8>(GL_PIXEL_PACK_BUFFER, GL_STREAM_READ) {}
+        ~PixelPackBuffer();
+        void ReadPixels(u32 width, u32 height);
+        std::span<const u8> Map();
+        void Unmap();
+    private:
+        GLsync m_fence = nullptr;
+        u32 m_byte_size = 0;
+        u32 m_capacity = 0;
+    };
+
+    // Framebuffer with a single color texture attachment
+    class Framebuffer : public GLObject {
+    public:
+        Framebuffer(u32 width, u32 height, GLenum internal_format = GL_RGBA8);
+        ~Framebuffer();
+        void Bind() const; // also sets the viewport to the framebuffer's size
+        void Resize(u32 width, u32 height);
+        void BindTexture(u32 unit) const;
+        u32 GetWidth() const { return m_width; }
+        u32 GetHeight() const { return m_height; }
+    private:
+        GLenum m_internal_format;
+        u32 m_texture;
+        u32 m_width = 0, m_height = 0;
+    };
+
+    // GPU time of the commands between Begin() and End(), measured with GL_TIME_ELAPSED
+    // queries. Results are read a few frames late so that polling never stalls.
+    class GpuTimer {
+    public:
+        static constexpr u32 QueryCount = 4;
+        GpuTimer();
+        ~GpuTimer();
+        u32 Begin(); // returns the measurement's index, as later reported by Poll()
+        void End();
+        // Takes the oldest finished measurement in milliseconds; false if none is ready
+        bool Poll(float* ms, u32* index);
+    private:
+        u32 m_queries[QueryCount];
+        u32 m_begun = 0, m_polled = 0;
+    };
+
     struct VertexAttribute {
         GLenum type;
         u32 num;
@@ -211,6 +302,7 @@ namespace glw {
         void SetIntVec(const std::string& name, const std::span<const i32>& value);
         void SetFloat(const std::string& name, float value);
         void SetFloatVec(const std::string& name, const std::span<float> value);
+        void SetVec2(const std::string& name, const glm::vec2& value);
         void SetVec3(const std::string& name, const glm::vec3& value);
         void SetVec3Vec(const std::string& name, const std::span<glm::vec3> value);
         void SetVec4(const std::string& name, const glm::vec4& value);
@@ -246,7 +338,12 @@ namespace glw {
         void SetPitch(float pitch);
          
         glm::vec3 GetFront() const { return m_front; }
+        void SetFront(const glm::vec3& front);
+        // Set whenever position or orientation actually change, until ClearDirty()
+        bool IsDirty() const { return m_dirty; }
+        void ClearDirty() { m_dirty = false; }
     private:
+        void UpdateFront();
         glm::vec3 m_pos = DefaultPos;
         float m_speed = DefaultSpeed;
         float m_sensitivity = DefaultSensitivity;
@@ -257,6 +354,7 @@ namespace glw {
         glm::mat4 m_projection;
         i32 m_last_mouse_x = 0, m_last_mouse_y = 0;
         float m_yaw = 0, m_pitch = 0;
+        bool m_dirty = true;
     };
 };
 
@@ -273,7 +371,7 @@ namespace glw {
 #endif
 
 namespace glw {
-    Context::Context(const char* window_name, u32 window_width, u32 window_height, bool fullscreen)
+    Context::Context(const char* window_name, u32 window_width, u32 window_height, bool fullscreen, bool hidden)
         : m_window_width(window_width), m_window_height(window_height)
     {
         // SDL
@@ -296,7 +394,7 @@ namespace glw {
             window_name,
             SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 
             m_window_width, m_window_height,
-            SDL_WINDOW_SHOWN | SDL_WINDOW_OPENGL | (fullscreen * SDL_WINDOW_FULLSCREEN)
+            (hidden ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN) | SDL_WINDOW_OPENGL | (fullscreen * SDL_WINDOW_FULLSCREEN)
         );
         if (m_window == nullptr) {
             SDL_LogError(
@@ -344,6 +442,12 @@ namespace glw {
     void Context::Present() {
         SDL_GL_SwapWindow(m_window);
     }
+    void Context::MakeCurrent() {
+        SDL_GL_MakeCurrent(m_window, m_context);
+    }
+    void Context::ReleaseCurrent() {
+        SDL_GL_MakeCurrent(m_window, nullptr);
+    }
     float Context::UpdateDeltaTime() {
         static u64 now = SDL_GetPerformanceCounter();
         static u64 then;
@@ -370,6 +474,197 @@ namespace glw {
 
     u32 GLObject::GetID() { return m_ID; }
 
+    StreamBuffer::StreamBuffer(GLenum buffer_type, u32 region_byte_size, u32 region_count)
+        : m_buffer_type(buffer_type), m_region_count(region_count), m_fences(region_count, nullptr)
+    {
+        if (!GLEW_ARB_buffer_storage) {
+            SDL_LogCritical(
+                SDL_LOG_CATEGORY_APPLICATION,
+                "StreamBuffer requires GL_ARB_buffer_storage (OpenGL 4.4)"
+            );
+            exit(1);
+        }
+
+        i32 alignment = m_alignment;
+        if (m_buffer_type == GL_UNIFORM_BUFFER)
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        else if (m_buffer_type == GL_SHADER_STORAGE_BUFFER)
+            glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        m_alignment = alignment;
+        m_region_size = AlignUp(region_byte_size, m_alignment);
+
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &m_ID);
+        Bind();
+        glBufferStorage(m_buffer_type, m_region_size * m_region_count, nullptr, flags);
+        m_mapped = static_cast<u8*>(
+            glMapBufferRange(m_buffer_type, 0, m_region_size * m_region_count, flags)
+        );
+    }
+    StreamBuffer::~StreamBuffer() {
+        for (GLsync fence : m_fences)
+            if (fence != nullptr)
+                glDeleteSync(fence);
+        Bind();
+        glUnmapBuffer(m_buffer_type);
+        glDeleteBuffers(1, &m_ID);
+    }
+    void StreamBuffer::Bind() const {
+        glBindBuffer(m_buffer_type, m_ID);
+    }
+    void StreamBuffer::BindRangeToIndex(u32 idx, const Allocation& allocation) const {
+        glBindBufferRange(m_buffer_type, idx, m_ID, allocation.offset, allocation.data.size());
+    }
+    void StreamBuffer::CopyTo(GLObject* dst, const Allocation& allocation, u32 dst_offset) const {
+        glBindBuffer(GL_COPY_READ_BUFFER, m_ID);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, dst->GetID());
+        glCopyBufferSubData(
+            GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+            allocation.offset, dst_offset, allocation.data.size()
+        );
+    }
+    void StreamBuffer::BeginFrame() {
+        m_head = 0;
+        m_last_wait_time = 0;
+        GLsync& fence = m_fences[m_region];
+        if (fence == nullptr)
+            return;
+
+        // Only flush and block if the GPU has not finished with this region yet
+        const u64 start = SDL_GetPerformanceCounter();
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        while (result == GL_TIMEOUT_EXPIRED)
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, WaitTimeoutNs);
+        glDeleteSync(fence);
+        fence = nullptr;
+
+        m_last_wait_time = (float)((SDL_GetPerformanceCounter() - start) * 1000 / (float)SDL_GetPerformanceFrequency());
+        m_total_wait_time += m_last_wait_time;
+    }
+    void StreamBuffer::EndFrame() {
+        m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        m_region = (m_region + 1) % m_region_count;
+    }
+    StreamBuffer::Allocation StreamBuffer::Allocate(u32 byte_size, u32 alignment) {
+        if (alignment == 0)
+            alignment = m_alignment;
+        u32 head = m_head.load();
+        u32 local_offset;
+        do {
+            local_offset = AlignUp(head, alignment);
+        } while (!m_head.compare_exchange_weak(head, local_offset + byte_size));
+        if (local_offset + byte_size > m_region_size)
+            return { {}, 0 };
+        const u32 offset = m_region * m_region_size + local_offset;
+        return { std::span<u8>(m_mapped + offset, byte_size), offset };
+    }
+    u32 StreamBuffer::AlignUp(u32 byte_size, u32 alignment) {
+        return (byte_size + alignment - 1) / alignment * alignment;
+    }
+
+    PixelPackBuffer::~PixelPackBuffer() {
+        if (m_fence != nullptr)
+            glDeleteSync(m_fence);
+    }
+    void PixelPackBuffer::ReadPixels(u32 width, u32 height) {
+        m_byte_size = width * height * 4;
+        Bind();
+        if (m_byte_size > m_capacity) {
+            Source(nullptr, m_byte_size);
+            m_capacity = m_byte_size;
+        }
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        if (m_fence != nullptr)
+            glDeleteSync(m_fence);
+        m_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    std::span<const u8> PixelPackBuffer::Map() {
+        if (m_fence != nullptr) {
+            while (glClientWaitSync(m_fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX) == GL_TIMEOUT_EXPIRED);
+            glDeleteSync(m_fence);
+            m_fence = nullptr;
+        }
+        Bind();
+        const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, m_byte_size, GL_MAP_READ_BIT);
+        return { static_cast<const u8*>(data), m_byte_size };
+    }
+    void PixelPackBuffer::Unmap() {
+        Bind();
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    Framebuffer::Framebuffer(u32 width, u32 height, GLenum internal_format)
+        : m_internal_format(internal_format)
+    {
+        glGenFramebuffers(1, &m_ID);
+        glGenTextures(1, &m_texture);
+        glBindTexture(GL_TEXTURE_2D, m_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        Resize(width, height);
+        glBindFramebuffer(GL_FRAMEBUFFER, m_ID);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texture, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Framebuffer %d is incomplete\n", m_ID);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    Framebuffer::~Framebuffer() {
+        glDeleteTextures(1, &m_texture);
+        glDeleteFramebuffers(1, &m_ID);
+    }
+    void Framebuffer::Bind() const {
+        glBindFramebuffer(GL_FRAMEBUFFER, m_ID);
+        glViewport(0, 0, m_width, m_height);
+    }
+    void Framebuffer::Resize(u32 width, u32 height) {
+        if (width == m_width && height == m_height)
+            return;
+        m_width = width;
+        m_height = height;
+        glBindTexture(GL_TEXTURE_2D, m_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, m_internal_format, m_width, m_height, 0, GL_RGBA, GL_FLOAT, nullptr);
+    }
+    void Framebuffer::BindTexture(u32 unit) const {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, m_texture);
+    }
+
+    GpuTimer::GpuTimer() {
+        glGenQueries(QueryCount, m_queries);
+    }
+    GpuTimer::~GpuTimer() {
+        glDeleteQueries(QueryCount, m_queries);
+    }
+    u32 GpuTimer::Begin() {
+        // Reusing a query discards its pending result
+        if (m_begun - m_polled == QueryCount)
+            m_polled++;
+        glBeginQuery(GL_TIME_ELAPSED, m_queries[m_begun % QueryCount]);
+        return m_begun++;
+    }
+    void GpuTimer::End() {
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+    bool GpuTimer::Poll(float* ms, u32* index) {
+        if (m_polled == m_begun)
+            return false;
+        const u32 query = m_queries[m_polled % QueryCount];
+        i32 available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return false;
+        u64 ns = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+        *ms = (float)(ns / 1e6);
+        *index = m_polled++;
+        return true;
+    }
+
     Shader::Shader(const std::string& vert_source, const std::string& frag_source) {
         Compile(vert_source, frag_source);
     }
@@ -395,6 +690,9 @@ namespace glw {
     void Shader::SetFloatVec(const std::string& name, const std::span<float> value) {
         glUniform1fv(glGetUniformLocation(m_ID, name.c_str()), value.size(), value.data());
     }
+    void Shader::SetVec2(const std::string& name, const glm::vec2& value) {
+        glUniform2fv(glGetUniformLocation(m_ID, name.c_str()), 1, &value[0]);
+    }
     void Shader::SetVec3(const std::string& name, const glm::vec3& value) {
         glUniform3fv(glGetUniformLocation(m_ID, name.c_str()), 1, &value[0]);
     }
@@ -476,10 +774,19 @@ namespace glw {
 
         m_pitch = glm::clamp(m_pitch, -89.0f, 89.0f);
 
-        m_front.x = glm::cos(glm::radians(m_yaw)) * glm::cos(glm::radians(m_pitch));
-        m_front.y = glm::sin(glm::radians(m_pitch));
-        m_front.z = glm::sin(glm::radians(m_yaw)) * glm::cos(glm::radians(m_pitch));
-        m_front = glm::normalize(m_front);
+        UpdateFront();
+    }
+    void FPSCamera::UpdateFront() {
+        glm::vec3 front;
+        front.x = glm::cos(glm::radians(m_yaw)) * glm::cos(glm::radians(m_pitch));
+        front.y = glm::sin(glm::radians(m_pitch));
+        front.z = glm::sin(glm::radians(m_yaw)) * glm::cos(glm::radians(m_pitch));
+        SetFront(glm::normalize(front));
+    }
+    void FPSCamera::SetFront(const glm::vec3& front) {
+        if (front != m_front)
+            m_dirty = true;
+        m_front = front;
     }
     void FPSCamera::Move(CameraMoveDir dir, float delta_time) {
         switch(dir) {
@@ -488,11 +795,14 @@ namespace glw {
             case CameraLeft: m_pos -= m_speed * glm::normalize(glm::cross(m_front, m_up)) * delta_time; break;
             case CameraRight: m_pos += m_speed * glm::normalize(glm::cross(m_front, m_up)) * delta_time; break;
         }
+        m_dirty = true;
     }
     glm::vec3 FPSCamera::GetPos() const {
         return m_pos;
     }
     void FPSCamera::SetPos(const glm::vec3& pos) {
+        if (pos != m_pos)
+            m_dirty = true;
         m_pos = pos;
     }
     float FPSCamera::GetSpeed() const {
@@ -506,12 +816,14 @@ namespace glw {
     }
     void FPSCamera::SetYaw(float yaw) {
         m_yaw = yaw;
+        UpdateFront();
     }
     float FPSCamera::GetPitch() const {
         return m_pitch;
     }
     void FPSCamera::SetPitch(float pitch) {
         m_pitch = pitch;
+        UpdateFront();
     }
 }
 
@@ -0,0 +1,141 @@
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+#include "common.hpp"
+#include <cmath>
+#include <zlib.h>
+
+struct Image {
+    string path;
+    u32 width = 0, height = 0;
+    vector<u8> pixels; // RGBA8, top row first
+};
+
+namespace image_detail {
+    inline void PutU32BE(vector<u8>* out, u32 value) {
+        const u8 bytes[4] = { u8(value >> 24), u8(value >> 16), u8(value >> 8), u8(value) };
+        out->insert(out->end(), bytes, bytes + 4);
+    }
+    template<typename T>
+    inline void PutLE(vector<u8>* out, T value) {
+        const u8* bytes = reinterpret_cast<const u8*>(&value);
+        out->insert(out->end(), bytes, bytes + sizeof(T));
+    }
+    inline void PutString(vector<u8>* out, const char* str) {
+        out->insert(out->end(), str, str + strlen(str) + 1);
+    }
+    inline void PutPngChunk(vector<u8>* out, const char* type, span<const u8> data) {
+        PutU32BE(out, data.size());
+        const u64 type_pos = out->size();
+        out->insert(out->end(), type, type + 4);
+        out->insert(out->end(), data.begin(), data.end());
+        PutU32BE(out, crc32(0, out->data() + type_pos, 4 + data.size()));
+    }
+    inline float SrgbToLinear(u8 value) {
+        const float c = value / 255.0f;
+        return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+}
+
+// RGBA8 PNG, rows unfiltered and deflated at zlib's fastest level
+inline void EncodePng(const Image& image, vector<u8>* out) {
+    using namespace image_detail;
+    const u64 row_size = image.width * 4;
+    vector<u8> raw;
+    raw.reserve((row_size + 1) * image.height);
+    for (u32 y = 0; y < image.height; y++) {
+        raw.push_back(0); // filter type: none
+        raw.insert(raw.end(), &image.pixels[y * row_size], &image.pixels[y * row_size] + row_size);
+    }
+    uLongf compressed_size = compressBound(raw.size());
+    vector<u8> compressed(compressed_size);
+    const i32 result = compress2(compressed.data(), &compressed_size, raw.data(), raw.size(), Z_BEST_SPEED);
+    ASSERT(result == Z_OK, "zlib failed with {}", result);
+
+    const u8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    out->clear();
+    out->insert(out->end(), signature, signature + 8);
+    vector<u8> header;
+    PutU32BE(&header, image.width);
+    PutU32BE(&header, image.height);
+    const u8 format[5] = { 8, 6, 0, 0, 0 }; // 8 bits per channel, RGBA, deflate, no filter, no interlace
+    header.insert(header.end(), format, format + 5);
+    PutPngChunk(out, "IHDR", header);
+    PutPngChunk(out, "IDAT", span<const u8>(compressed.data(), compressed_size));
+    PutPngChunk(out, "IEND", {});
+}
+
+// Uncompressed scanline OpenEXR with 32-bit float channels, converted from sRGB to linear
+inline void EncodeExr(const Image& image, vector<u8>* out) {
+    using namespace image_detail;
+    out->clear();
+    PutLE<u32>(out, 20000630); // magic
+    PutLE<u32>(out, 2);        // version, scanline file
+
+    PutString(out, "channels");
+    PutString(out, "chlist");
+    PutLE<i32>(out, 4 * 18 + 1);
+    for (const char* channel : { "A", "B", "G", "R" }) { // must be sorted
+        PutString(out, channel);
+        PutLE<i32>(out, 2); // FLOAT
+        PutLE<u32>(out, 0); // pLinear and reserved
+        PutLE<i32>(out, 1); // x sampling
+        PutLE<i32>(out, 1); // y sampling
+    }
+    out->push_back(0);
+    PutString(out, "compression");
+    PutString(out, "compression");
+    PutLE<i32>(out, 1);
+    out->push_back(0); // NO_COMPRESSION
+    for (const char* window : { "dataWindow", "displayWindow" }) {
+        PutString(out, window);
+        PutString(out, "box2i");
+        PutLE<i32>(out, 16);
+        PutLE<i32>(out, 0);
+        PutLE<i32>(out, 0);
+        PutLE<i32>(out, image.width - 1);
+        PutLE<i32>(out, image.height - 1);
+    }
+    PutString(out, "lineOrder");
+    PutString(out, "lineOrder");
+    PutLE<i32>(out, 1);
+    out->push_back(0); // INCREASING_Y
+    PutString(out, "pixelAspectRatio");
+    PutString(out, "float");
+    PutLE<i32>(out, 4);
+    PutLE<float>(out, 1.0f);
+    PutString(out, "screenWindowCenter");
+    PutString(out, "v2f");
+    PutLE<i32>(out, 8);
+    PutLE<float>(out, 0.0f);
+    PutLE<float>(out, 0.0f);
+    PutString(out, "screenWindowWidth");
+    PutString(out, "float");
+    PutLE<i32>(out, 4);
+    PutLE<float>(out, 1.0f);
+    out->push_back(0); // end of header
+
+    const u64 line_size = image.width * 4 * sizeof(float);
+    const u64 table_end = out->size() + image.height * sizeof(u64);
+    for (u32 y = 0; y < image.height; y++)
+        PutLE<u64>(out, table_end + y * (line_size + 8));
+    static constexpr u32 ChannelOrder[4] = { 3, 2, 1, 0 }; // A, B, G, R from RGBA
+    for (u32 y = 0; y < image.height; y++) {
+        PutLE<i32>(out, y);
+        PutLE<i32>(out, line_size);
+        const u8* row = &image.pixels[y * image.width * 4];
+        for (u32 channel : ChannelOrder)
+            for (u32 x = 0; x < image.width; x++)
+                PutLE<float>(out, channel == 3 ? row[x * 4 + 3] / 255.0f : SrgbToLinear(row[x * 4 + channel]));
+    }
+}
+
+// Picks the format from the extension of `image.path`, PNG unless it ends in .exr
+inline void EncodeImage(const Image& image, vector<u8>* out) {
+    if (image.path.ends_with(".exr"))
+        EncodeExr(image, out);
+    else
+        EncodePng(image, out);
+}
+
+#endif
@@ -1,92 +1,395 @@
 #include "common.hpp"
 #include <cstring>
+#include <cfloat>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <new>
 #define OGT_VOX_IMPLEMENTATION
 #include "../vendor/ogt_vox.h"
 #define GLW_IMPLEMENTATION
 #include "glw.hpp"
+#include "animation.hpp"
+#include "chunks.hpp"
+#include "image.hpp"
 
 enum {
     WND_WIDTH = 1024,
     WND_HEIGHT = 768,
-    VoxPaletteSize = 256
+    VoxPaletteSize = 256,
+    FrameDataBindIndex = 1,
+    StreamRegionSize = 4 << 20,
+    AnimFrameRate = 10, // .vox files do not store a playback rate
+    VoxelRunMergeGap = 64,
+    StagingAlignment = 4,
+    SimTickRate = 120,
+    LatencyReportInterval = 2, // seconds
+    DefaultBenchIterations = 100,
+    BatchReadbackDepth = 3,
+    BatchQueueDepth = 8,
+    MaxRefineSamples = 64,
+    IdleEventTimeout = 250 // milliseconds
 };
 
+constexpr float DefaultFov = 80.0f;
+constexpr glm::vec3 DefaultCameraPos = { 60, 60, 60 };
+constexpr float TargetFrameTime = 8.0f; // GPU milliseconds per frame while moving
+constexpr float MinRenderScale = 0.25f;
+
 struct Scene {
+    // Laid out as std430, see `scene` in rt.frag.glsl
     struct Metadata {
         glm::ivec3 size;
-        array<glm::vec4, VoxPaletteSize> palette;
+        alignas(16) array<glm::vec4, VoxPaletteSize> palette;
     };
     Metadata metadata;
-    vector<u8> voxels;
+    ChunkedVoxels voxels;
 };
 
-class Raytracer {
-public:
-    Raytracer(const string& vert_path, const string& frag_path)
-        : m_shader(), m_ssbo(0),
-        m_vertex_array_object(&m_vertex_buffer, {{GL_FLOAT, 2}}, &m_index_buffer) {}
-    void LoadScene(const string& path) {
-        string vox_file_contents;
-        File file(path);
-        ASSERT(file.IsValid(), "Could not open file!");
-        file.ReadAll(&vox_file_contents);
+// Per-frame uniform block, laid out as std140 (see `frame` in rt.frag.glsl)
+struct FrameData {
+    glm::mat4 inv_proj;
+    glm::mat4 inv_view;
+    glm::mat4 inv_model;
+    glm::vec4 cam_pos;
+    glm::vec4 jitter; // only xy are used
+};
+
+// Counts every operator new in the program, so that benchmarks can report heap churn
+// outside the arenas. Sized and array forms forward here; aligned ones are not counted.
+static std::atomic<u64> s_heap_allocation_count = 0;
+void* operator new(size_t size) {
+    s_heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+// ogt_vox's allocator hooks take no user data, so the arena is reachable through a global
+// for the duration of a load. Frees are no-ops; the arena is reset once the scene is gone.
+static LinearArena* s_vox_arena = nullptr;
+static void* VoxArenaAlloc(size_t size) {
+    return s_vox_arena->Alloc(size);
+}
+static void VoxArenaFree(void*) {}
+
+static glm::mat4 ToMat4(const ogt_vox_transform& t) {
+    return glm::mat4(
+        glm::vec4(t.m00, t.m01, t.m02, t.m03),
+        glm::vec4(t.m10, t.m11, t.m12, t.m13),
+        glm::vec4(t.m20, t.m21, t.m22, t.m23),
+        glm::vec4(t.m30, t.m31, t.m32, t.m33)
+    );
+}
+
+// Number of frames covered by the instance's model and transform keyframes
+static u32 InstanceFrameCount(const ogt_vox_instance* instance) {
+    u32 frame_count = 1;
+    const ogt_vox_anim_model& model_anim = instance->model_anim;
+    if (model_anim.num_keyframes > 0)
+        frame_count = std::max(frame_count, model_anim.keyframes[model_anim.num_keyframes - 1].frame_index + 1);
+    const ogt_vox_anim_transform& transform_anim = instance->transform_anim;
+    if (transform_anim.num_keyframes > 0)
+        frame_count = std::max(frame_count, transform_anim.keyframes[transform_anim.num_keyframes - 1].frame_index + 1);
+    return frame_count;
+}
+
+// Copies `model` into the corner of a grid of `size` cells, zeroing the rest
+static void ExpandModel(const ogt_vox_model* model, const glm::ivec3& size, u8* dst) {
+    memset(dst, 0, (u64)size.x * size.y * size.z);
+    for (u32 z = 0; z < model->size_z; z++)
+        for (u32 y = 0; y < model->size_y; y++)
+            memcpy(
+                dst + (z * size.y + y) * size.x,
+                model->voxel_data + (z * model->size_y + y) * model->size_x,
+                model->size_x
+            );
+}
+
+// Encodes every frame of the first instance's animation into `animation`, in a grid that
+// fits all of its models. Transforms are made relative to frame 0, so the first frame
+// renders exactly like a static scene. The scene receives frame 0.
+static void LoadAnimation(
+    const ogt_vox_scene* scene_data, u32 frame_count,
+    LinearArena* arena, Scene* scene, VoxAnimation* animation)
+{
+    const ogt_vox_instance* instance = &scene_data->instances[0];
+    const auto frame_model = [&](u32 frame) {
+        const u32 index = ogt_vox_sample_instance_model(instance, frame);
+        ASSERT(index < scene_data->num_models && scene_data->models[index] != nullptr,
+            "Animation frame {} refers to missing model {}!", frame, index);
+        return scene_data->models[index];
+    };
+    // MagicaVoxel rotates models around floor(size / 2)
+    const auto pivot = [&](u32 frame) {
+        const ogt_vox_model* model = frame_model(frame);
+        return glm::vec3(model->size_x / 2, model->size_y / 2, model->size_z / 2);
+    };
+    const auto frame_transform = [&](u32 frame) {
+        return ToMat4(ogt_vox_sample_instance_transform_global(instance, frame, scene_data));
+    };
+
+    glm::ivec3 size(0);
+    for (u32 frame = 0; frame < frame_count; frame++) {
+        const ogt_vox_model* model = frame_model(frame);
+        size.x = std::max(size.x, (i32)model->size_x);
+        size.y = std::max(size.y, (i32)model->size_y);
+        size.z = std::max(size.z, (i32)model->size_z);
+    }
+    scene->metadata.size = size;
+
+    const u32 cell_count = size.x * size.y * size.z;
+    u8* frame_voxels = static_cast<u8*>(arena->Alloc(cell_count));
+    const glm::mat4 to_first_frame =
+        glm::translate(glm::mat4(1.0f), pivot(0)) * glm::inverse(frame_transform(0));
+    for (u32 frame = 0; frame < frame_count; frame++) {
+        ExpandModel(frame_model(frame), size, frame_voxels);
+        animation->AddFrame(
+            span<const u8>(frame_voxels, cell_count),
+            to_first_frame * frame_transform(frame) * glm::translate(glm::mat4(1.0f), -pivot(frame))
+        );
+        if (frame == 0)
+            scene->voxels.Build(span<const u8>(frame_voxels, cell_count), size);
+    }
+    animation->Finish();
+}
+
+// The model a static scene shows: the first one with any voxels. That is models[0] when
+// ogt_vox culls empty models, so loads with and without keyframes agree.
+static const ogt_vox_model* FirstSolidModel(const ogt_vox_scene* scene_data) {
+    for (u32 i = 0; i < scene_data->num_models; i++) {
+        const ogt_vox_model* model = scene_data->models[i];
+        if (model == nullptr)
+            continue;
+        const u8* voxels = model->voxel_data;
+        if (std::any_of(voxels, voxels + model->size_x * model->size_y * model->size_z, [](u8 v) { return v != 0; }))
+            return model;
+    }
+    ASSERT(false, "File has no models!");
+    return nullptr;
+}
+
+// Parses a .vox file into `scene`, and its keyframes into `animation` if one is given.
+// All temporary memory (file contents and ogt_vox's scene) comes from `arena`, which is
+// reset before returning.
+void LoadVox(const string& path, LinearArena* arena, Scene* scene, VoxAnimation* animation = nullptr) {
+    File file(path);
+    ASSERT(file.IsValid(), "Could not open file!");
+    const u32 file_size = file.Size();
+    u8* file_contents = static_cast<u8*>(arena->Alloc(file_size));
+    file.Read(file_contents, file_size);
 
-        const ogt_vox_scene* scene_data = ogt_vox_read_scene(
-            (uint8_t*)vox_file_contents.data(), vox_file_contents.size()
+    s_vox_arena = arena;
+    ogt_vox_set_memory_allocator(VoxArenaAlloc, VoxArenaFree);
+    // Culling empty models renumbers them without updating model keyframes, so animations
+    // keep them; an empty frame then expands to an all-zero grid like any other model.
+    // Static scenes skip the empty ones in FirstSolidModel().
+    const ogt_vox_scene* scene_data = ogt_vox_read_scene_with_flags(
+        file_contents, file_size,
+        animation != nullptr ? k_read_scene_flags_keyframes | k_read_scene_flags_keep_empty_models_instances : 0
+    );
+    ASSERT(scene_data->num_models >= 1, "File has no models!");
+
+    // Scene palette
+    for (u32 i = 0; i < scene->metadata.palette.size(); i++) {
+        scene->metadata.palette[i] = glm::vec4(
+            scene_data->palette.color[i].r / 255.0f,
+            scene_data->palette.color[i].g / 255.0f,
+            scene_data->palette.color[i].b / 255.0f,
+            scene_data->palette.color[i].a / 255.0f
         );
-        ASSERT(scene_data->num_models >= 1, "File has no models!");
+    }
+
+    u32 frame_count = 1;
+    if (animation != nullptr && scene_data->num_instances >= 1)
+        frame_count = InstanceFrameCount(&scene_data->instances[0]);
 
+    if (frame_count > 1) {
+        LoadAnimation(scene_data, frame_count, arena, scene, animation);
+    }
+    else {
+        const ogt_vox_model* model = FirstSolidModel(scene_data);
         // Scene dimensions
-        m_scene.metadata.size.x = scene_data->models[0]->size_x;
-        m_scene.metadata.size.y = scene_data->models[0]->size_y;
-        m_scene.metadata.size.z = scene_data->models[0]->size_z;
-
-        // Scene palette
-        for (u32 i = 0; i < m_scene.metadata.palette.size(); i++) {
-            m_scene.metadata.palette[i] = glm::vec4(
-                scene_data->palette.color[i].r / 255.0f,
-                scene_data->palette.color[i].g / 255.0f,
-                scene_data->palette.color[i].b / 255.0f,
-                scene_data->palette.color[i].a / 255.0f
-            );
-        }
+        scene->metadata.size.x = model->size_x;
+        scene->metadata.size.y = model->size_y;
+        scene->metadata.size.z = model->size_z;
 
         // Voxel data (indices to palette)
         const u32 voxel_data_byte_size =
-            m_scene.metadata.size.x *
-            m_scene.metadata.size.y *
-            m_scene.metadata.size.z;
-        m_scene.voxels.resize(voxel_data_byte_size);
-        memcpy(m_scene.voxels.data(), scene_data->models[0]->voxel_data, voxel_data_byte_size);
+            scene->metadata.size.x *
+            scene->metadata.size.y *
+            scene->metadata.size.z;
+        scene->voxels.Build(
+            span<const u8>(model->voxel_data, voxel_data_byte_size),
+            scene->metadata.size
+        );
+    }
+
+    ogt_vox_destroy_scene(scene_data);
+    ogt_vox_set_memory_allocator(nullptr, nullptr);
+    s_vox_arena = nullptr;
+    arena->Reset();
+}
+
+void LogChunkStats(const ChunkedVoxels& voxels) {
+    const ChunkedVoxels::Stats stats = voxels.GetStats();
+    LOG("Chunks: {} total, {} uniform, {}/{}/{}/{} at 1/2/4/8 bits",
+        stats.chunk_count, stats.chunks_by_bits[0], stats.chunks_by_bits[1],
+        stats.chunks_by_bits[2], stats.chunks_by_bits[4], stats.chunks_by_bits[8]);
+    LOG("Compression: {} -> {} bytes ({:.2f}x), encode {:.2f} ms, decode {:.1f} ns per chunk",
+        stats.raw_bytes, stats.packed_bytes, (double)stats.raw_bytes / stats.packed_bytes,
+        stats.encode_time, voxels.MeasureDecodeTime());
+}
+
+// Loads the same file repeatedly without a window and reports time and allocations
+void BenchmarkLoad(const string& path, u32 iterations) {
+    LinearArena arena;
+    Scene scene;
+    const u64 heap_allocations_before = s_heap_allocation_count;
+    const u64 start = SDL_GetPerformanceCounter();
+    for (u32 i = 0; i < iterations; i++)
+        LoadVox(path, &arena, &scene);
+    const double total_time = (SDL_GetPerformanceCounter() - start) * 1000 / (double)SDL_GetPerformanceFrequency();
+    const u64 heap_allocations = s_heap_allocation_count - heap_allocations_before;
+
+    const LinearArena::Stats& stats = arena.GetStats();
+    LOG("Loaded {} {} times in {:.2f} ms ({:.3f} ms per load)",
+        path, iterations, total_time, total_time / iterations);
+    LOG("Arena: {} allocations ({} per load), {} bytes ({} per load)",
+        stats.allocation_count, stats.allocation_count / iterations,
+        stats.allocated_bytes, stats.allocated_bytes / iterations);
+    LOG("Arena blocks: {} from malloc, {} bytes reserved",
+        stats.system_allocation_count, stats.reserved_bytes);
+    LOG("Heap outside the arena: {} allocations ({:.2f} per load)",
+        heap_allocations, (double)heap_allocations / iterations);
+    LogChunkStats(scene.voxels);
+}
+
+class Raytracer {
+public:
+    Raytracer(const string& vert_path, const string& frag_path)
+        : m_shader(), m_ssbo(0), m_stream(GL_UNIFORM_BUFFER, StreamRegionSize),
+        m_vertex_array_object(&m_vertex_buffer, {{GL_FLOAT, 2}}, &m_index_buffer) {}
+    void LoadScene(const string& path) {
+        LoadVox(path, &m_load_arena, &m_scene, &m_animation);
+        if (m_animation.IsAnimated())
+            LOG("Animation: {} frames, {} voxel changes",
+                m_animation.GetFrameCount(), m_animation.GetChangeCount());
+        LogChunkStats(m_scene.voxels);
 
-        ogt_vox_destroy_scene(scene_data);
+        // Static scenes are marched in their packed form. Animated ones stay raw on the GPU,
+        // where a delta is a plain byte copy that never moves other chunks' data.
+        const bool chunked = !m_animation.IsAnimated();
 
         // Shader
         string vert_source, frag_source;
         File("src/shaders/rt.vert.glsl").ReadAll(&vert_source);
         File("src/shaders/rt.frag.glsl").ReadAll(&frag_source);
+        if (chunked)
+            frag_source.insert(frag_source.find('\n') + 1, "#define CHUNKED\n");
         m_shader.Compile(vert_source, frag_source);
-        m_shader.Bind();
-        m_shader.SetFloat("uRatio", (float)WND_WIDTH / (float)WND_HEIGHT);
 
         // Shader storage buffer
-        ByteBuffer ssbo_data;
-        ssbo_data.Add(&m_scene.metadata);
-        ssbo_data.Extend<u8>(m_scene.voxels);
-        m_ssbo.Source(ssbo_data.AsVec());
+        if (chunked) {
+            const span<const u32> packed = m_scene.voxels.GetData();
+            ByteBuffer ssbo_data(sizeof(Scene::Metadata) + packed.size_bytes(), &m_load_arena);
+            ssbo_data.Add(&m_scene.metadata);
+            ssbo_data.Extend<u32>(packed);
+            m_ssbo.Source(ssbo_data.AsSpan());
+        }
+        else {
+            const glm::ivec3 size = m_scene.metadata.size;
+            const u64 voxel_count = (u64)size.x * size.y * size.z;
+            ByteBuffer ssbo_data(sizeof(Scene::Metadata) + voxel_count, &m_load_arena);
+            ssbo_data.Add(&m_scene.metadata);
+            m_scene.voxels.Decompress(ssbo_data.AppendUninitialized(voxel_count));
+            m_ssbo.Source(ssbo_data.AsSpan());
+        }
+        m_load_arena.Reset();
 
         m_vertex_buffer.Source(m_vertices);
         m_index_buffer.Source(m_indices);
     }
-    void Render(const glw::FPSCamera& camera) {
+    // `anim_time` is in seconds and ignored for static scenes. `jitter` moves the rays
+    // by a sub-pixel offset, in NDC.
+    void Render(const glw::FPSCamera& camera, double anim_time = 0, glm::vec2 jitter = glm::vec2(0.0f)) {
+        m_stream.BeginFrame();
+        // Taken first, so that voxel uploads filling the region can never crowd it out
+        const glw::StreamBuffer::Allocation frame = m_stream.Allocate(sizeof(FrameData));
+        ASSERT(!frame.data.empty(), "Stream region is too small for the frame data!");
+
+        glm::mat4 model(1.0f);
+        if (m_animation.IsAnimated()) {
+            m_changed_voxels.clear();
+            m_animation.Seek((u32)(anim_time * (double)AnimFrameRate), [&](u32 index, u8 value) {
+                m_scene.voxels.SetIndex(index, value);
+                m_changed_voxels.push_back(index);
+            });
+            UploadVoxelChanges();
+            model = m_animation.GetTransform();
+        }
+
+        const FrameData frame_data = {
+            glm::inverse(camera.GetProjection()),
+            glm::inverse(camera.GetViewMatrix()),
+            glm::inverse(model),
+            glm::vec4(camera.GetPos(), 1.0f),
+            glm::vec4(jitter, 0.0f, 0.0f)
+        };
+        memcpy(frame.data.data(), &frame_data, sizeof(FrameData));
+        m_stream.BindRangeToIndex(FrameDataBindIndex, frame);
+
         m_shader.Bind();
-        m_shader.SetVec3("uCamPos", camera.GetPos());
-        m_shader.SetMat4("uInvProj", glm::inverse(camera.GetProjection()));
-        m_shader.SetMat4("uInvView", glm::inverse(camera.GetViewMatrix()));
-        m_vertex_array_object.Draw();
+        DrawQuad();
+
+        m_stream.EndFrame();
     }
+    // Draws the full screen quad with whatever shader is bound
+    void DrawQuad() { m_vertex_array_object.Draw(); }
+    const glw::StreamBuffer& GetStream() const { return m_stream; }
+    bool IsAnimated() const { return m_animation.IsAnimated(); }
 private:
+    // Streams the changed voxels into the SSBO. Nearby changes are merged into runs so
+    // that each run costs one staging write and one GPU-side copy.
+    void UploadVoxelChanges() {
+        if (m_changed_voxels.empty())
+            return;
+        // Seeking over several frames can produce unsorted and repeated indices
+        std::sort(m_changed_voxels.begin(), m_changed_voxels.end());
+        u32 i = 0;
+        while (i < m_changed_voxels.size()) {
+            const u32 run_begin = m_changed_voxels[i];
+            u32 run_end = run_begin + 1;
+            while (++i < m_changed_voxels.size() && m_changed_voxels[i] < run_end + VoxelRunMergeGap)
+                run_end = m_changed_voxels[i] + 1;
+            UploadVoxelRun(run_begin, run_end);
+        }
+    }
+    void UploadVoxelRun(u32 begin, u32 end) {
+        const u32 byte_size = end - begin;
+        const u32 dst_offset = sizeof(Scene::Metadata) + begin;
+        // Copy sources only need 4 byte alignment, not the uniform offset alignment
+        const glw::StreamBuffer::Allocation staging = m_stream.Allocate(byte_size, StagingAlignment);
+        if (staging.data.empty()) {
+            // The stream region is full this frame
+            m_run_bytes.resize(byte_size);
+            for (u32 i = 0; i < byte_size; i++)
+                m_run_bytes[i] = m_scene.voxels.GetIndex(begin + i);
+            m_ssbo.SubSource(dst_offset, m_run_bytes.data(), byte_size);
+            return;
+        }
+        for (u32 i = 0; i < byte_size; i++)
+            staging.data[i] = m_scene.voxels.GetIndex(begin + i);
+        m_stream.CopyTo(&m_ssbo, staging, dst_offset);
+    }
+
     Scene m_scene;
+    VoxAnimation m_animation;
+    vector<u32> m_changed_voxels;
+    vector<u8> m_run_bytes;
+    LinearArena m_load_arena;
     constexpr static array<glm::vec2, 4> m_vertices = {
         glm::vec2(1.0f,  1.0f),
         glm::vec2(1.0f, -1.0f),
@@ -96,11 +399,108 @@ private:
     constexpr static array<u32, 6> m_indices = { 0, 1, 3, 1, 2, 3 };
     glw::Shader m_shader;
     glw::ShaderStorageBuffer m_ssbo;
+    glw::StreamBuffer m_stream;
     glw::VertexBuffer<glm::vec2> m_vertex_buffer;
     glw::IndexBuffer<u32> m_index_buffer;
     glw::VertexArrayObject<glm::vec2, u32> m_vertex_array_object;
 };
 
+// Element `index` of the Halton sequence with the given base, in [0, 1)
+float Halton(u32 index, u32 base) {
+    float result = 0, fraction = 1;
+    while (index > 0) {
+        fraction /= base;
+        result += fraction * (index % base);
+        index /= base;
+    }
+    return result;
+}
+
+// Accumulates jittered samples of a still view into a float framebuffer for anti-aliasing,
+// and renders moving views at a reduced resolution that keeps the GPU within
+// TargetFrameTime. The display pass averages the samples and upsamples to the window.
+class ProgressiveRenderer {
+public:
+    ProgressiveRenderer(Raytracer* raytracer, u32 width, u32 height)
+        : m_raytracer(raytracer), m_accum(width, height, GL_RGBA32F)
+    {
+        string vert_source, frag_source;
+        File("src/shaders/rt.vert.glsl").ReadAll(&vert_source);
+        File("src/shaders/display.frag.glsl").ReadAll(&frag_source);
+        m_display_shader.Compile(vert_source, frag_source);
+    }
+    // Motion discards the accumulated samples, and so does the first still frame after
+    // it, because moving frames are rendered at reduced resolution
+    void Update(bool moving) {
+        if (moving || m_moving)
+            m_sample_count = 0;
+        m_moving = moving;
+    }
+    bool IsConverged() const { return !m_moving && m_sample_count >= MaxRefineSamples; }
+    void RenderSample(const glw::FPSCamera& camera, double anim_time) {
+        UpdateScale();
+        const float scale = m_moving ? m_scale : 1.0f;
+        const u32 width = std::max(1u, (u32)(m_accum.GetWidth() * scale));
+        const u32 height = std::max(1u, (u32)(m_accum.GetHeight() * scale));
+        m_uv_scale = glm::vec2((float)width / m_accum.GetWidth(), (float)height / m_accum.GetHeight());
+
+        m_accum.Bind();
+        glViewport(0, 0, width, height);
+        if (m_sample_count == 0) {
+            glClearColor(0, 0, 0, 0);
+            glClear(GL_COLOR_BUFFER_BIT);
+        }
+        glm::vec2 jitter(0.0f);
+        if (!m_moving) {
+            // Low discrepancy offsets within the pixel, 2 / size being one pixel in NDC
+            const glm::vec2 offset(Halton(m_sample_count + 1, 2), Halton(m_sample_count + 1, 3));
+            jitter = (offset - 0.5f) * 2.0f / glm::vec2(width, height);
+        }
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        const u32 measurement = m_timer.Begin();
+        m_measured_scales[measurement % glw::GpuTimer::QueryCount] = scale;
+        m_raytracer->Render(camera, anim_time, jitter);
+        m_timer.End();
+        glDisable(GL_BLEND);
+        m_sample_count++;
+    }
+    void Display(u32 width, u32 height) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+        m_display_shader.Bind();
+        m_accum.BindTexture(0);
+        m_display_shader.SetInt("uAccum", 0);
+        m_display_shader.SetVec2("uUvScale", m_uv_scale);
+        m_display_shader.SetFloat("uSampleWeight", 1.0f / std::max(m_sample_count, 1u));
+        m_raytracer->DrawQuad();
+    }
+    u32 GetSampleCount() const { return m_sample_count; }
+    float GetScale() const { return m_moving ? m_scale : 1.0f; }
+private:
+    // Render time grows with the pixel count, i.e. with the square of the scale
+    void UpdateScale() {
+        float ms;
+        u32 measurement;
+        while (m_timer.Poll(&ms, &measurement)) {
+            const float measured_scale = m_measured_scales[measurement % glw::GpuTimer::QueryCount];
+            const float full_time = ms / (measured_scale * measured_scale);
+            const float target_scale = glm::clamp(std::sqrt(TargetFrameTime / full_time), MinRenderScale, 1.0f);
+            m_scale = glm::mix(m_scale, target_scale, 0.5f);
+        }
+    }
+
+    Raytracer* m_raytracer;
+    glw::Framebuffer m_accum;
+    glw::Shader m_display_shader;
+    glw::GpuTimer m_timer;
+    array<float, glw::GpuTimer::QueryCount> m_measured_scales = {};
+    float m_scale = 1.0f;
+    glm::vec2 m_uv_scale = glm::vec2(1.0f);
+    u32 m_sample_count = 0;
+    bool m_moving = true;
+};
+
 void UpdateCamera(glw::FPSCamera* camera, float delta_time) {
     const glw::u8* keys = SDL_GetKeyboardState(nullptr);
 
@@ -116,14 +516,432 @@ void UpdateCamera(glw::FPSCamera* camera, float delta_time) {
     camera->ProcessMouse();
 }
 
-int main() {
-    glw::Context context("Voxel raytracer", WND_WIDTH, WND_HEIGHT);
+// State produced by one simulation tick and handed to the render thread
+struct SimSnapshot {
+    glm::vec3 cam_pos;
+    glm::vec3 cam_front;
+    double anim_time; // seconds
+    u64 time;       // performance counter at the end of the tick
+    u64 input_time; // performance counter when the latest input event was polled
+};
+
+struct SharedState {
+    TripleBuffer<SimSnapshot> snapshots;
+    std::atomic<bool> should_quit = false;
+    std::atomic<bool> redraw = false; // the window needs its last frame presented again
+    // Bumped by Notify() after anything the render thread waits for; it sleeps on this
+    // once its view has converged
+    std::atomic<u32> version = 0;
+    std::atomic<float> frame_time = 0;
+    std::atomic<float> upload_wait = 0;
+    std::atomic<u32> sample_count = 0;
+    std::atomic<float> render_scale = 1;
+    bool measure_latency = false;
 
+    void Notify() {
+        version++;
+        version.notify_one();
+    }
+};
+
+// Input-to-photon latency, measured from the moment an input event is polled to the
+// moment the first frame showing it has finished presenting
+struct LatencyStats {
+    u32 count = 0;
+    float sum = 0, min = FLT_MAX, max = 0;
+    void Add(float ms) {
+        count++;
+        sum += ms;
+        min = std::min(min, ms);
+        max = std::max(max, ms);
+    }
+    void Report() {
+        if (count != 0)
+            LOG("Input latency: avg {:.2f} ms, min {:.2f} ms, max {:.2f} ms over {} samples",
+                sum / count, min, max, count);
+        *this = LatencyStats();
+    }
+};
+
+// Renders one tick behind the simulation, interpolating between the last two snapshots.
+// Frames that would show nothing new are skipped: a still view is refined until it has
+// MaxRefineSamples samples, then the thread sleeps until the simulation publishes again.
+void RenderLoop(glw::Context* context, Raytracer* raytracer, glw::FPSCamera camera, SharedState* shared) {
+    context->MakeCurrent();
+
+    const u64 frequency = SDL_GetPerformanceFrequency();
+    const u64 tick_counts = frequency / SimTickRate;
+    shared->snapshots.Update();
+    SimSnapshot prev = shared->snapshots.ReadSlot();
+    SimSnapshot curr = prev;
+
+    // Scoped so that the renderer's GL objects are deleted while the context is current
+    {
+        const u32 width = context->GetWindowWidth(), height = context->GetWindowHeight();
+        ProgressiveRenderer progressive(raytracer, width, height);
+        double last_anim_time = -1;
+
+        LatencyStats latency;
+        u64 last_measured_input = curr.input_time;
+        u64 last_report = SDL_GetPerformanceCounter();
+
+        while (!shared->should_quit) {
+            // Read before the snapshot so that a publish in between cuts the wait short. Quitting
+            // sets should_quit before notifying, so a version read after that sees it here.
+            const u32 seen_version = shared->version;
+            if (shared->should_quit)
+                break;
+            if (shared->snapshots.Update()) {
+                prev = curr;
+                curr = shared->snapshots.ReadSlot();
+            }
+            const u64 render_time = SDL_GetPerformanceCounter() - tick_counts;
+            float alpha = 1.0f;
+            if (curr.time > prev.time)
+                alpha = glm::clamp(
+                    (float)(((double)render_time - (double)prev.time) / (double)(curr.time - prev.time)),
+                    0.0f, 1.0f
+                );
+            camera.SetPos(glm::mix(prev.cam_pos, curr.cam_pos, alpha));
+            camera.SetFront(glm::normalize(glm::mix(prev.cam_front, curr.cam_front, alpha)));
+            const double anim_time = prev.anim_time + (curr.anim_time - prev.anim_time) * alpha;
+
+            progressive.Update(camera.IsDirty() || anim_time != last_anim_time);
+            camera.ClearDirty();
+            last_anim_time = anim_time;
+            if (progressive.IsConverged()) {
+                if (shared->redraw.exchange(false)) {
+                    progressive.Display(width, height);
+                    context->Present();
+                }
+                shared->version.wait(seen_version);
+                continue;
+            }
+
+            shared->frame_time = context->UpdateDeltaTime();
+            progressive.RenderSample(camera, anim_time);
+            progressive.Display(width, height);
+            context->Present();
+            shared->upload_wait = raytracer->GetStream().GetLastWaitTime();
+            shared->sample_count = progressive.GetSampleCount();
+            shared->render_scale = progressive.GetScale();
+
+            if (!shared->measure_latency)
+                continue;
+            glFinish();
+            const u64 now = SDL_GetPerformanceCounter();
+            // The input shows once interpolation has fully reached the snapshot carrying it
+            if (curr.input_time != last_measured_input && render_time >= curr.time) {
+                latency.Add((float)((now - curr.input_time) * 1000 / (double)frequency));
+                last_measured_input = curr.input_time;
+            }
+            if (now - last_report >= LatencyReportInterval * frequency) {
+                latency.Report();
+                last_report = now;
+            }
+        }
+    }
+
+    context->ReleaseCurrent();
+}
+
+struct Options {
+    string scene_path = "res/spellbook.vox";
+    u32 width = WND_WIDTH, height = WND_HEIGHT;
+    bool measure_latency = false;
+    string bench_path;
+    u32 bench_iterations = DefaultBenchIterations;
+    string batch_path;
+    bool cpu = false;
+};
+
+Options ParseOptions(i32 argc, char** argv) {
+    Options options;
+    for (i32 i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        if (arg == "--latency") {
+            options.measure_latency = true;
+        }
+        else if (arg == "--size") {
+            ASSERT(i + 1 < argc && sscanf(argv[i + 1], "%ux%u", &options.width, &options.height) == 2,
+                "Usage: --size <width>x<height>");
+            i++;
+        }
+        else if (arg == "--bench-load") {
+            ASSERT(i + 1 < argc, "Usage: --bench-load <file.vox> [iterations]");
+            options.bench_path = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                options.bench_iterations = std::stoi(argv[++i]);
+        }
+        else if (arg == "--batch") {
+            ASSERT(i + 1 < argc, "Usage: --batch <jobs.txt> [--cpu]");
+            options.batch_path = argv[++i];
+        }
+        else if (arg == "--cpu") {
+            options.cpu = true;
+        }
+        else {
+            ASSERT(arg[0] != '-', "Unknown option {}", arg);
+            options.scene_path = arg;
+        }
+    }
+    return options;
+}
+
+// A batch job file lists one scene and the views to render of it:
+//   scene res/spellbook.vox
+//   fov 80
+//   view <x> <y> <z> <yaw> <pitch> <width> <height> <output.png|output.exr>
+// Empty lines and lines starting with '#' are ignored.
+struct BatchView {
+    glm::vec3 pos;
+    float yaw, pitch;
+    u32 width, height;
+    string output;
+};
+struct BatchFile {
+    string scene_path;
+    float fov = DefaultFov;
+    vector<BatchView> views;
+};
+
+BatchFile ParseBatchFile(const string& path) {
+    File file(path);
+    ASSERT(file.IsValid(), "Could not open batch file {}!", path);
+    string contents;
+    file.ReadAll(&contents);
+
+    BatchFile batch;
+    std::istringstream lines(contents);
+    string line;
+    for (u32 line_number = 1; std::getline(lines, line); line_number++) {
+        std::istringstream tokens(line);
+        string command;
+        if (!(tokens >> command) || command[0] == '#')
+            continue;
+        bool valid = false;
+        if (command == "scene") {
+            valid = static_cast<bool>(tokens >> batch.scene_path);
+        }
+        else if (command == "fov") {
+            valid = static_cast<bool>(tokens >> batch.fov);
+        }
+        else if (command == "view") {
+            BatchView view;
+            // Read signed, since extracting "-1" into an unsigned wraps instead of failing
+            i32 width = 0, height = 0;
+            valid = static_cast<bool>(
+                tokens >> view.pos.x >> view.pos.y >> view.pos.z >> view.yaw >> view.pitch
+                       >> width >> height >> view.output
+            );
+            ASSERT(!valid || (width > 0 && height > 0),
+                "{}:{}: view size must be positive, got {}x{}", path, line_number, width, height);
+            view.width = width;
+            view.height = height;
+            batch.views.push_back(view);
+        }
+        ASSERT(valid, "{}:{}: invalid line '{}'", path, line_number, line);
+    }
+    ASSERT(!batch.scene_path.empty(), "{}: no scene given", path);
+    return batch;
+}
+
+glw::FPSCamera BatchCamera(const BatchFile& batch, const BatchView& view) {
+    glw::FPSCamera camera(batch.fov, (float)view.width / (float)view.height);
+    camera.SetPos(view.pos);
+    camera.SetYaw(view.yaw);
+    camera.SetPitch(view.pitch);
+    return camera;
+}
+
+// Renders the views on the GPU through an offscreen framebuffer. Readbacks go through a
+// ring of pixel buffers, so each view is only mapped BatchReadbackDepth views later,
+// once the GPU is long done with it.
+void RenderBatchGpu(const BatchFile& batch, BoundedQueue<Image>* images) {
+    glw::Context context("Voxel raytracer", 1, 1, false, true);
     Raytracer raytracer("src/shaders/rt.vert.glsl", "src/shaders/rt.frag.glsl");
-    raytracer.LoadScene("res/spellbook.vox");
+    raytracer.LoadScene(batch.scene_path);
+    glw::Framebuffer framebuffer(1, 1);
+    array<glw::PixelPackBuffer, BatchReadbackDepth> readbacks;
 
-    glw::FPSCamera camera(80.0f, (float)WND_WIDTH / (float)WND_HEIGHT);
-    camera.SetPos(glm::vec3(60, 60, 60));
+    const u32 view_count = batch.views.size();
+    for (u32 i = 0; i < view_count + BatchReadbackDepth; i++) {
+        glw::PixelPackBuffer& readback = readbacks[i % BatchReadbackDepth];
+        if (i >= BatchReadbackDepth) {
+            const BatchView& view = batch.views[i - BatchReadbackDepth];
+            Image image = { view.output, view.width, view.height, {} };
+            image.pixels.reserve(view.width * view.height * 4);
+            const span<const u8> pixels = readback.Map();
+            // GL rows start at the bottom
+            const u32 row_size = view.width * 4;
+            for (u32 y = view.height; y-- > 0;)
+                image.pixels.insert(image.pixels.end(), &pixels[y * row_size], &pixels[y * row_size] + row_size);
+            readback.Unmap();
+            images->Push(std::move(image));
+        }
+        if (i < view_count) {
+            const BatchView& view = batch.views[i];
+            framebuffer.Resize(view.width, view.height);
+            framebuffer.Bind();
+            raytracer.Render(BatchCamera(batch, view));
+            readback.ReadPixels(view.width, view.height);
+        }
+    }
+}
+
+// Renders the views with the CPU traversal, no GL context needed. One pool of
+// `thread_count` tracers (this thread included) runs for the whole batch and takes rows
+// one at a time, in view order, from a shared counter; Raycast() only reads the scene, so
+// they share it. Whoever traces the last row of a view passes its image on.
+void RenderBatchCpu(const BatchFile& batch, u32 thread_count, BoundedQueue<Image>* images) {
+    LinearArena arena;
+    Scene scene;
+    LoadVox(batch.scene_path, &arena, &scene);
+
+    struct ViewTrace {
+        std::once_flag setup; // camera and image, made by the first thread to reach the view
+        glm::mat4 inv_proj, inv_view;
+        glm::vec3 pos;
+        Image image;
+        std::atomic<u32> rows_left;
+    };
+    vector<ViewTrace> traces(batch.views.size());
+    vector<u64> view_ends(batch.views.size()); // global row index past each view's last row
+    u64 row_count = 0;
+    for (u32 i = 0; i < batch.views.size(); i++) {
+        row_count += batch.views[i].height;
+        view_ends[i] = row_count;
+        traces[i].rows_left = batch.views[i].height;
+    }
+
+    std::atomic<u64> next_row = 0;
+    auto trace_rows = [&]() {
+        // Rows are taken in increasing order, so each thread only ever moves forward
+        u32 v = 0;
+        for (u64 row = next_row++; row < row_count; row = next_row++) {
+            while (row >= view_ends[v])
+                v++;
+            const BatchView& view = batch.views[v];
+            ViewTrace& trace = traces[v];
+            std::call_once(trace.setup, [&]() {
+                const glw::FPSCamera camera = BatchCamera(batch, view);
+                trace.inv_proj = glm::inverse(camera.GetProjection());
+                trace.inv_view = glm::inverse(camera.GetViewMatrix());
+                trace.pos = camera.GetPos();
+                trace.image = { view.output, view.width, view.height, vector<u8>(view.width * view.height * 4) };
+            });
+
+            const u32 y = view.height - (u32)(view_ends[v] - row);
+            for (u32 x = 0; x < view.width; x++) {
+                // Same ray setup as rt.frag.glsl, with the top row first
+                const glm::vec2 ndc(
+                    (x + 0.5f) / view.width * 2.0f - 1.0f,
+                    1.0f - (y + 0.5f) / view.height * 2.0f
+                );
+                const glm::vec4 target = trace.inv_proj * glm::vec4(ndc, 1.0f, 1.0f);
+                const glm::vec3 dir = glm::vec3(trace.inv_view * glm::vec4(glm::normalize(glm::vec3(target) / target.w), 0.0f));
+                const glm::vec4 color = scene.metadata.palette[scene.voxels.Raycast(trace.pos, dir)];
+                u8* pixel = &trace.image.pixels[(y * view.width + x) * 4];
+                for (u32 c = 0; c < 4; c++)
+                    pixel[c] = (u8)(glm::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+            if (--trace.rows_left == 0)
+                images->Push(std::move(trace.image));
+        }
+    };
+    vector<std::thread> tracers;
+    for (u32 i = 1; i < thread_count; i++)
+        tracers.emplace_back(trace_rows);
+    trace_rows();
+    for (std::thread& tracer : tracers)
+        tracer.join();
+}
+
+// Loads the batch's scene once and renders every view back to back. Rendering, encoding
+// and writing run as a pipeline: this thread renders, a pool of encoder threads turns
+// images into PNG/EXR, and one writer thread puts them on disk.
+i32 RunBatch(const Options& options) {
+    const BatchFile batch = ParseBatchFile(options.batch_path);
+
+    struct EncodedImage {
+        string path;
+        vector<u8> bytes;
+    };
+    BoundedQueue<Image> images(BatchQueueDepth);
+    BoundedQueue<EncodedImage> encoded_images(BatchQueueDepth);
+
+    // The writer mostly waits on the disk and is not given a core. The GPU path keeps one
+    // core for its render thread; the CPU path's tracing outweighs encoding, so tracers get
+    // most of the cores.
+    const u32 core_count = std::max(1u, std::thread::hardware_concurrency());
+    const u32 encoder_count = options.cpu ? std::max(1u, core_count / 4) : std::max(2u, core_count) - 1;
+    const u32 tracer_count = std::max(1u, core_count - encoder_count);
+    vector<std::thread> encoders;
+    for (u32 i = 0; i < encoder_count; i++) {
+        encoders.emplace_back([&]() {
+            Image image;
+            while (images.Pop(&image)) {
+                EncodedImage encoded = { image.path, {} };
+                EncodeImage(image, &encoded.bytes);
+                encoded_images.Push(std::move(encoded));
+            }
+        });
+    }
+    u32 failed_writes = 0;
+    std::thread writer([&]() {
+        EncodedImage encoded;
+        while (encoded_images.Pop(&encoded)) {
+            File file(encoded.path, "wb");
+            if (!file.IsValid()) {
+                LOG("Could not write {}", encoded.path);
+                failed_writes++;
+                continue;
+            }
+            file.Write(encoded.bytes.data(), encoded.bytes.size());
+        }
+    });
+
+    const u64 start = SDL_GetPerformanceCounter();
+    if (options.cpu)
+        RenderBatchCpu(batch, tracer_count, &images);
+    else
+        RenderBatchGpu(batch, &images);
+    const double render_time = (SDL_GetPerformanceCounter() - start) * 1000 / (double)SDL_GetPerformanceFrequency();
+
+    images.Close();
+    for (std::thread& encoder : encoders)
+        encoder.join();
+    encoded_images.Close();
+    writer.join();
+    const double total_time = (SDL_GetPerformanceCounter() - start) * 1000 / (double)SDL_GetPerformanceFrequency();
+
+    LOG("Rendered {} views in {:.2f} ms, finished in {:.2f} ms ({:.1f} views/s) with {} encoders",
+        batch.views.size(), render_time, total_time, batch.views.size() * 1000 / total_time, encoder_count);
+    if (options.cpu)
+        LOG("Traced on {} threads", tracer_count);
+    LOG("Renderer blocked on encoders for {:.2f} ms", images.GetPushWaitTime());
+    return failed_writes == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    const Options options = ParseOptions(argc, argv);
+    if (!options.bench_path.empty()) {
+        BenchmarkLoad(options.bench_path, options.bench_iterations);
+        return 0;
+    }
+    if (!options.batch_path.empty())
+        return RunBatch(options);
+
+    SharedState shared;
+    shared.measure_latency = options.measure_latency;
+
+    glw::Context context("Voxel raytracer", options.width, options.height);
+
+    Raytracer raytracer("src/shaders/rt.vert.glsl", "src/shaders/rt.frag.glsl");
+    raytracer.LoadScene(options.scene_path);
+
+    glw::FPSCamera camera(DefaultFov, (float)options.width / (float)options.height);
+    camera.SetPos(DefaultCameraPos);
     camera.SetSpeed(glw::FPSCamera::DefaultSpeed * 3);
 
     const std::vector<glm::vec3> cube_vertices = {
@@ -143,24 +961,81 @@ int main() {
     glw::VertexBuffer<glm::vec3> bounds_vbo;
     glw::VertexArrayObject bounds_vao(&bounds_vbo, { { GL_FLOAT, 3 } });
 
-    bool should_quit = false;
-    SDL_Event evt;
-    while (!should_quit) {
-        const float delta_time = context.UpdateDeltaTime();
-        SDL_SetWindowTitle(context.GetWindow(), std::to_string(1000.0f / delta_time).c_str());
+    const u64 tick_counts = SDL_GetPerformanceFrequency() / SimTickRate;
+    const float tick_time = 1000.0f / (float)SimTickRate;
+    u64 input_time = 0;
+    double anim_time = 0;
+    u64 next_tick = SDL_GetPerformanceCounter();
+    u64 last_title_update = 0;
+
+    auto publish = [&]() {
+        shared.snapshots.WriteSlot() = {
+            camera.GetPos(), camera.GetFront(), anim_time, SDL_GetPerformanceCounter(), input_time
+        };
+        shared.snapshots.Publish();
+        shared.Notify();
+    };
+    camera.ClearDirty();
+    publish();
 
+    // The GL context moves to the render thread; this thread keeps input and simulation
+    context.ReleaseCurrent();
+    std::thread render_thread(RenderLoop, &context, &raytracer, camera, &shared);
+
+    SDL_Event evt;
+    while (!shared.should_quit) {
         while (SDL_PollEvent(&evt)) {
             switch (evt.type) {
                 case SDL_QUIT:
-                    should_quit = true;
+                    shared.should_quit = true;
+                    shared.Notify();
+                    break;
+                case SDL_KEYDOWN: case SDL_KEYUP: case SDL_MOUSEMOTION:
+                    input_time = SDL_GetPerformanceCounter();
+                    break;
+                case SDL_WINDOWEVENT:
+                    shared.redraw = true;
+                    shared.Notify();
                     break;
             }
         }
 
-        UpdateCamera(&camera, delta_time);
-        
-        raytracer.Render(camera);
-        context.Present();
+        UpdateCamera(&camera, tick_time);
+        const bool changed = camera.IsDirty() || raytracer.IsAnimated();
+        camera.ClearDirty();
+        if (changed) {
+            anim_time += raytracer.IsAnimated() ? tick_time / 1000.0 : 0.0;
+            publish();
+        }
+
+        if (SDL_GetPerformanceCounter() - last_title_update >= SDL_GetPerformanceFrequency() / 4) {
+            const string title = std::format(
+                "{:.1f} fps, {:.0f}% resolution, {} samples, {:.3f} ms upload wait",
+                1000.0f / shared.frame_time, shared.render_scale * 100.0f,
+                shared.sample_count.load(), shared.upload_wait.load()
+            );
+            SDL_SetWindowTitle(context.GetWindow(), title.c_str());
+            last_title_update = SDL_GetPerformanceCounter();
+        }
+
+        if (!changed) {
+            // Nothing moves without input, so block until the next event instead of ticking
+            SDL_WaitEventTimeout(nullptr, IdleEventTimeout);
+            next_tick = SDL_GetPerformanceCounter();
+            continue;
+        }
+
+        // Fixed rate; if a tick overran, resynchronize instead of trying to catch up
+        next_tick += tick_counts;
+        const u64 now = SDL_GetPerformanceCounter();
+        if (next_tick > now)
+            std::this_thread::sleep_for(std::chrono::microseconds(
+                (next_tick - now) * 1000000 / SDL_GetPerformanceFrequency()
+            ));
+        else
+            next_tick = now;
     }
-}
 
+    render_thread.join();
+    context.MakeCurrent();
+}
@@ -0,0 +1,15 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 FragPos;
+
+uniform sampler2D uAccum;
+uniform vec2 uUvScale;     // part of uAccum that was rendered to
+uniform float uSampleWeight; // 1 / accumulated sample count
+
+void main() {
+    vec2 uv = (FragPos * 0.5 + 0.5) * uUvScale;
+    // Keep the bilinear upsampling from reaching texels outside the rendered part
+    uv = min(uv, uUvScale - 0.5 / vec2(textureSize(uAccum, 0)));
+    FragColor = texture(uAccum, uv) * uSampleWeight;
+}
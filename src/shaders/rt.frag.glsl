@@ -12,9 +12,13 @@ layout (std430, binding = 0) buffer scene {
     uint voxel_data[];
 };
 
-uniform vec3 uCamPos;
-uniform mat4 uInvProj;
-uniform mat4 uInvView;
+layout (std140, binding = 1) uniform frame {
+    mat4 uInvProj;
+    mat4 uInvView;
+    mat4 uInvModel;
+    vec3 uCamPos;
+    vec2 uJitter; // sub-pixel offset in NDC, for progressive anti-aliasing
+};
 
 // - divide by 4 to get index into i32's
 // - shift left by 8 * (3 - idx % 4)
@@ -31,6 +35,33 @@ uint ByteAt(uint x, uint y, uint z) {
     return ByteAt(CoordIdx(x, y, z));
 }
 
+#ifdef CHUNKED
+// voxel_data holds the packed chunks described in chunks.hpp: two header words per
+// 8x8x8 chunk, then per chunk a local palette and 1/2/4/8-bit cell indices
+#define CHUNK_EDGE 8
+
+uint VoxelAt(ivec3 p) {
+    ivec3 grid = (size + CHUNK_EDGE - 1) / CHUNK_EDGE;
+    ivec3 c = p / CHUNK_EDGE;
+    ivec3 l = p % CHUNK_EDGE;
+    uint chunk = uint((c.z * grid.y + c.y) * grid.x + c.x);
+    uint h0 = voxel_data[chunk * 2u];
+    uint h1 = voxel_data[chunk * 2u + 1u];
+    uint bits = h0 & 15u;
+    if (bits == 0u)
+        return h1;
+    uint bit = uint((l.z * CHUNK_EDGE + l.y) * CHUNK_EDGE + l.x) * bits;
+    uint idx = (voxel_data[h1 + (bit >> 5u)] >> (bit & 31u)) & ((1u << bits) - 1u);
+    if (bits == 8u)
+        return idx;
+    return ByteAt((h0 >> 4u) + idx);
+}
+#else
+uint VoxelAt(ivec3 p) {
+    return ByteAt(p.x, p.y, p.z);
+}
+#endif
+
 struct Ray {
     vec3 origin;
     vec3 direction;
@@ -117,16 +148,17 @@ vec4 MarchRay(Ray ray) {
                 side = 1;
             }
         }
-        voxel = ByteAt(map.x, map.y, map.z);
+        voxel = VoxelAt(map);
     } while (voxel == 0);
     return palette[voxel];
 }
 void main() {
-    vec4 target = uInvProj * vec4(FragPos.xy, 1, 1);
+    vec4 target = uInvProj * vec4(FragPos.xy + uJitter, 1, 1);
     vec3 ray_dir = vec3(uInvView * vec4(normalize(vec3(target) / target.w), 0));
     Ray ray;
-    ray.origin = uCamPos;
-    ray.direction = ray_dir;
+    // March in the voxel grid's own space so animated transforms never touch voxel data
+    ray.origin = vec3(uInvModel * vec4(uCamPos, 1));
+    ray.direction = vec3(uInvModel * vec4(ray_dir, 0));
 
     vec4 result = MarchRay(ray);
 